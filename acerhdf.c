@@ -38,12 +38,22 @@
 #include <sys/param.h>
 #include <sys/module.h>
 #include <sys/kernel.h>
+#include <sys/limits.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/proc.h>
 #include <sys/reboot.h>
+#include <sys/resource.h>
+#include <sys/sched.h>
 #include <sys/types.h>
 #include <sys/systm.h>
+#include <sys/time.h>
 #include <contrib/dev/acpica/include/acpi.h>
 #include <sys/bus.h>
 #include <dev/acpica/acpivar.h>
+#include <machine/cpufunc.h>
+#include <machine/md_var.h>
+#include <machine/specialreg.h>
 
 #if __FreeBSD__ < 11
 // kern_getenv is getenv in FreeBSD < 11
@@ -77,6 +87,55 @@
 #define ACERHDF_MAX_INTERVAL 15
 #define ACERHDF_MIN_INTERVAL 1
 
+/*
+ * At attach time the EC registers are read ACERHDF_PROBE_READS times to
+ * check that they return sane values and to measure how long a read takes.
+ * The interval is then kept long enough that a temperature check, which
+ * needs up to ACERHDF_TICK_EC_OPS EC transactions, occupies the EC for at
+ * most 1/ACERHDF_EC_DUTY of the time.
+ */
+#define ACERHDF_PROBE_READS 8
+/* temperature read, fanreg and mreg read, fanreg and mreg write */
+#define ACERHDF_TICK_EC_OPS 5
+#define ACERHDF_EC_DUTY 100
+#define ACERHDF_PROBE_MIN_TEMP 10
+#define ACERHDF_PROBE_MAX_SPREAD 5
+
+/*
+ * The EC temperature lags the actual power draw by several seconds. If the
+ * CPU utilization averaged over one poll interval is at least loadon percent,
+ * switch the fan to auto early, before the fan-on threshold is reached.
+ */
+#define ACERHDF_MAX_LOADON 100
+#define ACERHDF_MIN_LOADON 0
+
+/*
+ * The load has to stay above loadon for ACERHDF_LOAD_ON_TICKS intervals in a
+ * row before the fan is turned on, and below it for ACERHDF_LOAD_OFF_TICKS
+ * intervals before it may be turned off again, so that a load hovering
+ * around loadon does not toggle the fan on every check.
+ */
+#define ACERHDF_LOAD_ON_TICKS 2
+#define ACERHDF_LOAD_OFF_TICKS 3
+
+/*
+ * The on-die digital thermal sensor reports the distance to TjMax. Its exact
+ * value does not matter much as the readings are calibrated against the EC
+ * temperature anyway, so just use the Atom N270's.
+ */
+#define ACERHDF_TJMAX 90
+
+/*
+ * With the on-die sensor selected, the EC temperature is only read every
+ * calibrate ticks, or when the on-die estimate moved at least
+ * calibrate_delta degrees away from the last EC reading.
+ */
+#define ACERHDF_MAX_CALIBRATE 60
+#define ACERHDF_MIN_CALIBRATE 1
+
+#define ACERHDF_MAX_CALIBRATE_DELTA 20
+#define ACERHDF_MIN_CALIBRATE_DELTA 1
+
 /*
  * cmd_off:  to switch the fan completely off and check if the fan is off
  * cmd_auto: to set the BIOS in control of the fan. The BIOS then
@@ -98,6 +157,20 @@ static const struct manualcmd mcmd = {
     .moff = 0xff,
 };
 
+/*
+ * Maximum number of partial fan speeds in manual mode. Above the highest one
+ * the BIOS is put back in control of the fan. There are no known good mreg
+ * values for them, so they have to be set with the hw.acerhdf.speed1..3
+ * loader tunables, slowest first.
+ */
+#define ACERHDF_FAN_SPEEDS 3
+
+/* Degrees below its threshold before a speed is left again */
+#define ACERHDF_SPEED_HYST 2
+
+/* mreg holds a value that is neither moff nor one of the speed values */
+#define ACERHDF_SPEED_UNKNOWN -1
+
 /* BIOS settings */
 struct bios_settings {
     const char *vendor;
@@ -228,9 +301,22 @@ static const struct bios_settings bios_tbl[] = {
 
 typedef enum {
     ACERHDF_FAN_OFF,
-    ACERHDF_FAN_AUTO
+    ACERHDF_FAN_AUTO,
+    ACERHDF_FAN_MANUAL
 } acerhdf_fanstate;
 
+typedef enum {
+    ACERHDF_SENSOR_EC,
+    ACERHDF_SENSOR_DIE
+} acerhdf_sensor;
+
+/* What made the driver turn the fan on the last time */
+typedef enum {
+    ACERHDF_TRIGGER_NONE,
+    ACERHDF_TRIGGER_TEMP,
+    ACERHDF_TRIGGER_LOAD
+} acerhdf_trigger;
+
 struct acerhdf_softc {
     device_t dev;
     device_t ec_dev;
@@ -241,6 +327,42 @@ struct acerhdf_softc {
     UINT8 fanon;
     UINT8 fanoff;
     int enabled;
+    int min_interval;
+
+    int ec_probe;
+    int ec_latency_avg;
+    int ec_latency_max;
+
+    int speed;
+    int nspeeds;
+    int speeds[ACERHDF_FAN_SPEEDS];
+    UINT8 mspeed[ACERHDF_FAN_SPEEDS];
+    int nmspeeds;
+
+    int loadon;
+    int load;
+    int load_high;
+    int load_low;
+    long cp_last[CPUSTATES];
+
+    acerhdf_trigger trigger;
+    int fanon_count;
+    int fanon_peak;
+    int loadon_count;
+    int loadon_peak;
+
+    acerhdf_sensor sensor;
+    int die_supported;
+    int calibrate;
+    int calibrate_delta;
+    int calibrated;
+    int ec_age;
+    int ec_temp;
+    int die_offset;
+    int ec_samples;
+    int die_samples;
+    int divergence;
+    int divergence_max;
 
     struct sysctl_ctx_list *sysctl_ctx;
     struct sysctl_oid *sysctl_tree;
@@ -253,15 +375,26 @@ ACPI_SERIAL_DECL(acerhdf, "Acer Aspire One fan control");
 static const struct bios_settings *bios_cfg = NULL;
 
 static ACPI_STATUS acerhdf_set_fanstate(struct acerhdf_softc *,
-                                        acerhdf_fanstate);
+                                        acerhdf_fanstate, int);
 static ACPI_STATUS acerhdf_get_fanstate(struct acerhdf_softc *,
                                         acerhdf_fanstate *);
 static ACPI_STATUS acerhdf_get_temperature(struct acerhdf_softc *, int *);
+static ACPI_STATUS acerhdf_get_die_temperature(struct acerhdf_softc *, int *);
+static ACPI_STATUS acerhdf_sample_temperature(struct acerhdf_softc *, int *);
+static int acerhdf_get_load(struct acerhdf_softc *);
+static int acerhdf_curve_speed(struct acerhdf_softc *, int);
+static int acerhdf_probe_ec(struct acerhdf_softc *);
 static int acerhdf_sysctl_fanon(SYSCTL_HANDLER_ARGS);
 static int acerhdf_sysctl_fanoff(SYSCTL_HANDLER_ARGS);
 static int acerhdf_sysctl_temperature(SYSCTL_HANDLER_ARGS);
 static int acerhdf_sysctl_interval(SYSCTL_HANDLER_ARGS);
 static int acerhdf_sysctl_enabled(SYSCTL_HANDLER_ARGS);
+static int acerhdf_sysctl_loadon(SYSCTL_HANDLER_ARGS);
+static int acerhdf_sysctl_stats_reset(SYSCTL_HANDLER_ARGS);
+static int acerhdf_sysctl_speeds(SYSCTL_HANDLER_ARGS);
+static int acerhdf_sysctl_sensor(SYSCTL_HANDLER_ARGS);
+static int acerhdf_sysctl_calibrate(SYSCTL_HANDLER_ARGS);
+static int acerhdf_sysctl_calibrate_delta(SYSCTL_HANDLER_ARGS);
 static void acerhdf_task(struct acerhdf_softc *, int);
 static void acerhdf_tick(void *);
 static int str_starts_with(const char *, const char *);
@@ -269,28 +402,44 @@ static int acerhdf_probe(device_t dev);
 static int acerhdf_attach(device_t dev);
 static int acerhdf_detach(device_t dev);
 
+/* speed is only used for ACERHDF_FAN_MANUAL and starts at 1 */
 static ACPI_STATUS
-acerhdf_set_fanstate(struct acerhdf_softc *sc, acerhdf_fanstate state) {
+acerhdf_set_fanstate(struct acerhdf_softc *sc, acerhdf_fanstate state,
+                     int speed) {
     UINT64 cmd;
 
-    cmd = state == ACERHDF_FAN_OFF ?
-        bios_cfg->cmd.cmd_off : bios_cfg->cmd.cmd_auto;
+    if (state == ACERHDF_FAN_MANUAL &&
+        (!bios_cfg->mcmd_enable || speed < 1 || speed > sc->nmspeeds)) {
+        return AE_BAD_PARAMETER;
+    }
+
+    /* Manual mode is entered with the off command on these models */
+    cmd = state == ACERHDF_FAN_AUTO ?
+        bios_cfg->cmd.cmd_auto : bios_cfg->cmd.cmd_off;
 
     ACPI_STATUS retval = ACPI_EC_WRITE(sc->ec_dev, bios_cfg->fanreg, cmd, 1);
     if (ACPI_FAILURE(retval)) {
         return retval;
     }
 
-    if (bios_cfg->mcmd_enable && state == ACERHDF_FAN_OFF) {
-        retval = ACPI_EC_WRITE(sc->ec_dev, mcmd.mreg, mcmd.moff, 1);
+    if (bios_cfg->mcmd_enable && state != ACERHDF_FAN_AUTO) {
+        cmd = state == ACERHDF_FAN_OFF ? mcmd.moff : sc->mspeed[speed - 1];
+        retval = ACPI_EC_WRITE(sc->ec_dev, mcmd.mreg, cmd, 1);
         if (ACPI_FAILURE(retval)) {
             return retval;
         }
     }
 
+    sc->speed = state == ACERHDF_FAN_MANUAL ? speed : 0;
+
     if (bootverbose) {
-        device_printf(sc->dev, "fan state changed to '%s'\n",
-                      state == ACERHDF_FAN_OFF ? "off" : "auto");
+        if (state == ACERHDF_FAN_MANUAL) {
+            device_printf(sc->dev, "fan state changed to 'manual %d'\n",
+                          speed);
+        } else {
+            device_printf(sc->dev, "fan state changed to '%s'\n",
+                          state == ACERHDF_FAN_OFF ? "off" : "auto");
+        }
     }
 
     return retval;
@@ -305,11 +454,37 @@ acerhdf_get_fanstate(struct acerhdf_softc *sc, acerhdf_fanstate *state)
                                       bios_cfg->fanreg,
                                       &fan,
                                       0);
-    if (ACPI_SUCCESS(retval)) {
-        if (fan == bios_cfg->cmd.cmd_off) {
-            *state = ACERHDF_FAN_OFF;
-        } else {
-            *state = ACERHDF_FAN_AUTO;
+    if (ACPI_FAILURE(retval)) {
+        return retval;
+    }
+
+    if (fan != bios_cfg->cmd.cmd_off) {
+        *state = ACERHDF_FAN_AUTO;
+        sc->speed = 0;
+        return retval;
+    }
+
+    *state = ACERHDF_FAN_OFF;
+    sc->speed = 0;
+
+    /* Only look at the manual mode register if we might have used it */
+    if (bios_cfg->mcmd_enable && sc->nspeeds > 0) {
+        retval = ACPI_EC_READ(sc->ec_dev, mcmd.mreg, &fan, 1);
+        if (ACPI_FAILURE(retval)) {
+            return retval;
+        }
+
+        if (fan != mcmd.moff) {
+            int i;
+
+            *state = ACERHDF_FAN_MANUAL;
+            sc->speed = ACERHDF_SPEED_UNKNOWN; // rewritten by the next task run
+            for (i = 0; i < sc->nmspeeds; i++) {
+                if (fan == sc->mspeed[i]) {
+                    sc->speed = i + 1;
+                    break;
+                }
+            }
         }
     }
 
@@ -332,6 +507,226 @@ acerhdf_get_temperature(struct acerhdf_softc *sc, int *t)
     return retval;
 }
 
+/*
+ * Uncalibrated die temperature of CPU 0. Like coretemp(4), bind to the CPU
+ * for the read so that the offset is always applied to the same core.
+ */
+static ACPI_STATUS
+acerhdf_get_die_temperature(struct acerhdf_softc *sc, int *t)
+{
+    uint64_t msr;
+    int error;
+
+    if (!sc->die_supported) {
+        return AE_ERROR;
+    }
+
+    thread_lock(curthread);
+    sched_bind(curthread, 0);
+    thread_unlock(curthread);
+
+    error = rdmsr_safe(MSR_THERM_STATUS, &msr);
+
+    thread_lock(curthread);
+    sched_unbind(curthread);
+    thread_unlock(curthread);
+
+    if (error != 0 || !(msr & (1U << 31))) {
+        return AE_ERROR;
+    }
+
+    *t = ACERHDF_TJMAX - ((msr >> 16) & 0x7f);
+
+    return AE_OK;
+}
+
+/*
+ * Temperature from the selected sensor. The on-die sensor is cheap to read,
+ * so it is used whenever its last calibration against the EC is recent
+ * enough and it still roughly agrees with the last EC reading.
+ */
+static ACPI_STATUS
+acerhdf_sample_temperature(struct acerhdf_softc *sc, int *t)
+{
+    ACPI_STATUS retval;
+    int die = 0, ec;
+    int die_valid = 0;
+
+    if (sc->sensor == ACERHDF_SENSOR_DIE &&
+        ACPI_SUCCESS(acerhdf_get_die_temperature(sc, &die))) {
+        die_valid = 1;
+        sc->die_samples++;
+
+        int estimate = die + sc->die_offset;
+        if (sc->calibrated &&
+            sc->ec_age < sc->calibrate &&
+            abs(estimate - sc->ec_temp) < sc->calibrate_delta &&
+            estimate < ACERHDF_TEMP_CRIT) {
+            sc->ec_age++;
+            *t = estimate;
+            return AE_OK;
+        }
+    }
+
+    retval = acerhdf_get_temperature(sc, &ec);
+    if (ACPI_FAILURE(retval)) {
+        return retval;
+    }
+    sc->ec_samples++;
+
+    if (die_valid) {
+        if (sc->calibrated) {
+            sc->divergence = abs(die + sc->die_offset - ec);
+            if (sc->divergence > sc->divergence_max) {
+                sc->divergence_max = sc->divergence;
+            }
+        }
+        sc->die_offset = ec - die;
+        sc->calibrated = 1;
+        sc->ec_age = 1; // this check counts towards calibrate
+    }
+
+    sc->ec_temp = ec;
+    *t = ec;
+
+    return AE_OK;
+}
+
+/*
+ * Time a burst of temperature and fan register reads and check that the
+ * values make sense for bios_cfg. Sets the minimum poll interval from the
+ * measured latency. Returns 0 if the EC looks usable.
+ */
+static int
+acerhdf_probe_ec(struct acerhdf_softc *sc)
+{
+    UINT64 temp, fan;
+    sbintime_t start, elapsed, total = 0, max = 0;
+    int tmin = INT_MAX, tmax = INT_MIN;
+    int i;
+
+    ACPI_SERIAL_BEGIN(acerhdf);
+    for (i = 0; i < ACERHDF_PROBE_READS; i++) {
+        start = sbinuptime();
+        if (ACPI_FAILURE(ACPI_EC_READ(sc->ec_dev, bios_cfg->tempreg,
+                                      &temp, 1))) {
+            ACPI_SERIAL_END(acerhdf);
+            device_printf(sc->dev, "reading the temperature failed\n");
+            return ENXIO;
+        }
+        elapsed = sbinuptime() - start;
+        total += elapsed;
+        max = MAX(max, elapsed);
+
+        start = sbinuptime();
+        if (ACPI_FAILURE(ACPI_EC_READ(sc->ec_dev, bios_cfg->fanreg,
+                                      &fan, 1))) {
+            ACPI_SERIAL_END(acerhdf);
+            device_printf(sc->dev, "reading the fan state failed\n");
+            return ENXIO;
+        }
+        elapsed = sbinuptime() - start;
+        total += elapsed;
+        max = MAX(max, elapsed);
+
+        tmin = MIN(tmin, (int)temp);
+        tmax = MAX(tmax, (int)temp);
+    }
+    ACPI_SERIAL_END(acerhdf);
+
+    sc->ec_latency_avg = total / (2 * ACERHDF_PROBE_READS) / SBT_1US;
+    sc->ec_latency_max = max / SBT_1US;
+    sc->min_interval = howmany((int64_t)sc->ec_latency_max *
+                               ACERHDF_TICK_EC_OPS * ACERHDF_EC_DUTY,
+                               1000000);
+    sc->min_interval = MAX(sc->min_interval, ACERHDF_MIN_INTERVAL);
+
+    if (bootverbose) {
+        device_printf(sc->dev,
+                      "EC read latency avg %d us, max %d us, "
+                      "temperature %d-%d C, fan 0x%x\n",
+                      sc->ec_latency_avg,
+                      sc->ec_latency_max,
+                      tmin,
+                      tmax,
+                      (unsigned int)fan);
+    }
+
+    if (tmin < ACERHDF_PROBE_MIN_TEMP || tmax >= ACERHDF_TEMP_CRIT ||
+        tmax - tmin > ACERHDF_PROBE_MAX_SPREAD) {
+        device_printf(sc->dev,
+                      "implausible temperature readings (%d-%d C)\n",
+                      tmin, tmax);
+        return ENXIO;
+    }
+
+    /* An unmapped register typically reads as all ones */
+    if (fan == 0xff && bios_cfg->cmd.cmd_off != 0xff &&
+        bios_cfg->cmd.cmd_auto != 0xff) {
+        device_printf(sc->dev, "implausible fan register value 0x%x\n",
+                      (unsigned int)fan);
+        return ENXIO;
+    }
+
+    /* A slow EC only limits how often we poll, it is not a reason to fail */
+    if (sc->min_interval > ACERHDF_MAX_INTERVAL) {
+        device_printf(sc->dev, "EC slow (%d us per read), polling every %d s\n",
+                      sc->ec_latency_max, ACERHDF_MAX_INTERVAL);
+        sc->min_interval = ACERHDF_MAX_INTERVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * Manual fan speed for the given temperature according to the curve set via
+ * the speeds sysctl, 0 means off. A speed is only left again once the
+ * temperature has dropped ACERHDF_SPEED_HYST degrees below its threshold.
+ */
+static int
+acerhdf_curve_speed(struct acerhdf_softc *sc, int temperature)
+{
+    int speed = 0;
+    int i;
+
+    for (i = 0; i < sc->nspeeds; i++) {
+        int threshold = sc->speeds[i];
+
+        if (i < sc->speed) {
+            threshold -= ACERHDF_SPEED_HYST;
+        }
+        if (temperature >= threshold) {
+            speed = i + 1;
+        }
+    }
+
+    return speed;
+}
+
+/* CPU utilization in percent since the last call */
+static int
+acerhdf_get_load(struct acerhdf_softc *sc)
+{
+    long cp_time[CPUSTATES];
+    long total = 0, idle;
+    int i;
+
+    read_cpu_time(cp_time);
+
+    for (i = 0; i < CPUSTATES; i++) {
+        total += cp_time[i] - sc->cp_last[i];
+    }
+    idle = cp_time[CP_IDLE] - sc->cp_last[CP_IDLE];
+
+    memcpy(sc->cp_last, cp_time, sizeof(sc->cp_last));
+
+    if (total <= 0) {
+        return 0;
+    }
+
+    return (total - idle) * 100 / total;
+}
+
 static int
 acerhdf_sysctl_fanon(SYSCTL_HANDLER_ARGS)
 {
@@ -348,6 +743,11 @@ acerhdf_sysctl_fanon(SYSCTL_HANDLER_ARGS)
         return EINVAL;
     }
 
+    /* The manual fan speeds are only used below fanon */
+    if (sc->nspeeds > 0 && temp <= sc->speeds[sc->nspeeds - 1]) {
+        return EINVAL;
+    }
+
     sc->fanon = temp;
 
     return 0;
@@ -403,7 +803,7 @@ acerhdf_sysctl_interval(SYSCTL_HANDLER_ARGS)
         return error;
     }
 
-    if (t > ACERHDF_MAX_INTERVAL || t < ACERHDF_MIN_INTERVAL) {
+    if (t > ACERHDF_MAX_INTERVAL || t < sc->min_interval) {
         return EINVAL;
     }
 
@@ -424,6 +824,11 @@ acerhdf_sysctl_enabled(SYSCTL_HANDLER_ARGS)
         return error;
     }
 
+    if (val == 1 && !sc->ec_probe) {
+        // Don't take over, or even touch, a fan we could not verify we can read
+        return ENODEV;
+    }
+
     if (val != 0 && val != 1) {
         error = EINVAL;
     } else {
@@ -433,13 +838,191 @@ acerhdf_sysctl_enabled(SYSCTL_HANDLER_ARGS)
     if (!sc->enabled) {
         // Make sure the fan is on when we are not in control of it!
         ACPI_SERIAL_BEGIN(acerhdf);
-        acerhdf_set_fanstate(sc, ACERHDF_FAN_AUTO);
+        acerhdf_set_fanstate(sc, ACERHDF_FAN_AUTO, 0);
+        sc->trigger = ACERHDF_TRIGGER_NONE;
         ACPI_SERIAL_END(acerhdf);
     }
 
     return error;
 }
 
+static int
+acerhdf_sysctl_loadon(SYSCTL_HANDLER_ARGS)
+{
+    struct acerhdf_softc *sc = (struct acerhdf_softc *)oidp->oid_arg1;
+    int error = 0;
+    int val = sc->loadon;
+
+    error = sysctl_handle_int(oidp, &val, 0, req);
+    if (error || !req->newptr) {
+        return error;
+    }
+
+    if (val > ACERHDF_MAX_LOADON || val < ACERHDF_MIN_LOADON) {
+        return EINVAL;
+    }
+
+    sc->loadon = val;
+
+    return 0;
+}
+
+/* Reset the fanon/loadon statistics together so both cover the same time */
+static int
+acerhdf_sysctl_stats_reset(SYSCTL_HANDLER_ARGS)
+{
+    struct acerhdf_softc *sc = (struct acerhdf_softc *)oidp->oid_arg1;
+    int error = 0;
+    int val = 0;
+
+    error = sysctl_handle_int(oidp, &val, 0, req);
+    if (error || !req->newptr) {
+        return error;
+    }
+
+    if (val != 1) {
+        return EINVAL;
+    }
+
+    ACPI_SERIAL_BEGIN(acerhdf);
+    sc->fanon_count = 0;
+    sc->fanon_peak = 0;
+    sc->loadon_count = 0;
+    sc->loadon_peak = 0;
+    ACPI_SERIAL_END(acerhdf);
+
+    return 0;
+}
+
+static int
+acerhdf_sysctl_speeds(SYSCTL_HANDLER_ARGS)
+{
+    struct acerhdf_softc *sc = (struct acerhdf_softc *)oidp->oid_arg1;
+    int speeds[ACERHDF_FAN_SPEEDS];
+    char buf[32];
+    char *p, *tok, *end;
+    int error = 0;
+    int i, n = 0;
+    long val;
+
+    buf[0] = '\0';
+    for (i = 0; i < sc->nspeeds; i++) {
+        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "%s%d",
+                 i > 0 ? "," : "", sc->speeds[i]);
+    }
+
+    error = sysctl_handle_string(oidp, buf, sizeof(buf), req);
+    if (error || !req->newptr) {
+        return error;
+    }
+
+    /* Only with a manual mode and speed values from the loader tunables */
+    if (!bios_cfg->mcmd_enable || sc->nmspeeds == 0) {
+        return ENODEV;
+    }
+
+    /* Comma separated, ascending temperatures, empty to disable */
+    p = buf;
+    while ((tok = strsep(&p, ",")) != NULL) {
+        if (*tok == '\0' && n == 0 && p == NULL) {
+            break;
+        }
+        if (n >= sc->nmspeeds) {
+            return EINVAL;
+        }
+        val = strtol(tok, &end, 10);
+        if (*tok == '\0' || *end != '\0' ||
+            val < ACERHDF_MIN_FANOFF || val >= sc->fanon ||
+            (n > 0 && val <= speeds[n - 1])) {
+            return EINVAL;
+        }
+        speeds[n++] = val;
+    }
+
+    ACPI_SERIAL_BEGIN(acerhdf);
+    /* Hand the fan to the BIOS, the next check picks the new speed */
+    if (sc->speed != 0) {
+        acerhdf_set_fanstate(sc, ACERHDF_FAN_AUTO, 0);
+        sc->trigger = ACERHDF_TRIGGER_NONE;
+    }
+    memcpy(sc->speeds, speeds, n * sizeof(speeds[0]));
+    sc->nspeeds = n;
+    ACPI_SERIAL_END(acerhdf);
+
+    return 0;
+}
+
+static int
+acerhdf_sysctl_sensor(SYSCTL_HANDLER_ARGS)
+{
+    struct acerhdf_softc *sc = (struct acerhdf_softc *)oidp->oid_arg1;
+    int error = 0;
+    int val = sc->sensor;
+
+    error = sysctl_handle_int(oidp, &val, 0, req);
+    if (error || !req->newptr) {
+        return error;
+    }
+
+    if (val != ACERHDF_SENSOR_EC && val != ACERHDF_SENSOR_DIE) {
+        return EINVAL;
+    }
+
+    if (val == ACERHDF_SENSOR_DIE && !sc->die_supported) {
+        return ENODEV;
+    }
+
+    ACPI_SERIAL_BEGIN(acerhdf);
+    sc->sensor = val;
+    sc->calibrated = 0;
+    ACPI_SERIAL_END(acerhdf);
+
+    return 0;
+}
+
+static int
+acerhdf_sysctl_calibrate(SYSCTL_HANDLER_ARGS)
+{
+    struct acerhdf_softc *sc = (struct acerhdf_softc *)oidp->oid_arg1;
+    int error = 0;
+    int val = sc->calibrate;
+
+    error = sysctl_handle_int(oidp, &val, 0, req);
+    if (error || !req->newptr) {
+        return error;
+    }
+
+    if (val > ACERHDF_MAX_CALIBRATE || val < ACERHDF_MIN_CALIBRATE) {
+        return EINVAL;
+    }
+
+    sc->calibrate = val;
+
+    return 0;
+}
+
+static int
+acerhdf_sysctl_calibrate_delta(SYSCTL_HANDLER_ARGS)
+{
+    struct acerhdf_softc *sc = (struct acerhdf_softc *)oidp->oid_arg1;
+    int error = 0;
+    int val = sc->calibrate_delta;
+
+    error = sysctl_handle_int(oidp, &val, 0, req);
+    if (error || !req->newptr) {
+        return error;
+    }
+
+    if (val > ACERHDF_MAX_CALIBRATE_DELTA ||
+        val < ACERHDF_MIN_CALIBRATE_DELTA) {
+        return EINVAL;
+    }
+
+    sc->calibrate_delta = val;
+
+    return 0;
+}
+
 static int
 acerhdf_sysctl_fanstate(SYSCTL_HANDLER_ARGS)
 {
@@ -459,6 +1042,8 @@ acerhdf_sysctl_fanstate(SYSCTL_HANDLER_ARGS)
         description = "auto";
     } else if (state == ACERHDF_FAN_OFF) {
         description = "off";
+    } else if (state == ACERHDF_FAN_MANUAL) {
+        description = "manual";
     } else {
         return EINVAL;
     }
@@ -482,12 +1067,21 @@ acerhdf_task(struct acerhdf_softc *sc, int pending __unused)
 
     ACPI_SERIAL_BEGIN(acerhdf);
 
+    sc->load = acerhdf_get_load(sc);
+    if (sc->loadon > 0 && sc->load >= sc->loadon) {
+        sc->load_high = MIN(sc->load_high + 1, ACERHDF_LOAD_ON_TICKS);
+        sc->load_low = 0;
+    } else {
+        sc->load_high = 0;
+        sc->load_low = MIN(sc->load_low + 1, ACERHDF_LOAD_OFF_TICKS);
+    }
+
     if (!sc->enabled) {
         goto reset;
     }
 
     int temperature;
-    error = acerhdf_get_temperature(sc, &temperature);
+    error = acerhdf_sample_temperature(sc, &temperature);
     if (ACPI_FAILURE(error)) {
         goto reset;
     }
@@ -505,10 +1099,44 @@ acerhdf_task(struct acerhdf_softc *sc, int pending __unused)
         goto reset;
     }
 
-    if (temperature >= sc->fanon && fanstate == ACERHDF_FAN_OFF) {
-        acerhdf_set_fanstate(sc, ACERHDF_FAN_AUTO);
-    } else if (temperature <= sc->fanoff && fanstate == ACERHDF_FAN_AUTO) {
-        acerhdf_set_fanstate(sc, ACERHDF_FAN_OFF);
+    int loaded = sc->load_high >= ACERHDF_LOAD_ON_TICKS;
+    int unloaded = sc->loadon == 0 || sc->load_low >= ACERHDF_LOAD_OFF_TICKS;
+
+    int speed = acerhdf_curve_speed(sc, temperature);
+
+    if (fanstate != ACERHDF_FAN_AUTO) {
+        if (temperature >= sc->fanon) {
+            error = acerhdf_set_fanstate(sc, ACERHDF_FAN_AUTO, 0);
+            if (ACPI_SUCCESS(error)) {
+                sc->trigger = ACERHDF_TRIGGER_TEMP;
+                sc->fanon_count++;
+            }
+        } else if (loaded) {
+            error = acerhdf_set_fanstate(sc, ACERHDF_FAN_AUTO, 0);
+            if (ACPI_SUCCESS(error)) {
+                sc->trigger = ACERHDF_TRIGGER_LOAD;
+                sc->loadon_count++;
+            }
+        } else if (speed != sc->speed) {
+            acerhdf_set_fanstate(sc,
+                                 speed ? ACERHDF_FAN_MANUAL : ACERHDF_FAN_OFF,
+                                 speed);
+        }
+    } else if (temperature <= sc->fanoff && unloaded) {
+        error = acerhdf_set_fanstate(sc,
+                                     speed ? ACERHDF_FAN_MANUAL : ACERHDF_FAN_OFF,
+                                     speed);
+        if (ACPI_SUCCESS(error)) {
+            sc->trigger = ACERHDF_TRIGGER_NONE;
+        }
+    }
+
+    /* Track the peak temperature per trigger to judge the feedforward path */
+    if (sc->trigger == ACERHDF_TRIGGER_TEMP && temperature > sc->fanon_peak) {
+        sc->fanon_peak = temperature;
+    } else if (sc->trigger == ACERHDF_TRIGGER_LOAD &&
+               temperature > sc->loadon_peak) {
+        sc->loadon_peak = temperature;
     }
 
  reset:
@@ -612,6 +1240,8 @@ acerhdf_attach(device_t dev)
 {
     struct acerhdf_softc *sc;
     devclass_t ec_devclass;
+    char name[32];
+    int i, val;
 
     sc = device_get_softc(dev);
     sc->dev = dev;
@@ -628,9 +1258,6 @@ acerhdf_attach(device_t dev)
         return (EINVAL);
     }
 
-    callout_init(&sc->tick_handle, CALLOUT_MPSAFE);
-    callout_reset(&sc->tick_handle, sc->interval * hz, acerhdf_tick, sc);
-
     /* Get the sysctl tree */
     sc->sysctl_ctx = device_get_sysctl_ctx(dev);
     sc->sysctl_tree = device_get_sysctl_tree(dev);
@@ -640,6 +1267,38 @@ acerhdf_attach(device_t dev)
     sc->interval = 5; // seconds
     sc->fanoff = 53; // degree celsius
     sc->fanon = 60; // degree celsius
+    sc->loadon = 0; // percent, 0 = disabled
+    sc->nspeeds = 0; // on/off control only
+    sc->nmspeeds = 0;
+    for (i = 0; bios_cfg->mcmd_enable && i < ACERHDF_FAN_SPEEDS; i++) {
+        snprintf(name, sizeof(name), "hw.acerhdf.speed%d", i + 1);
+        if (!TUNABLE_INT_FETCH(name, &val)) {
+            break;
+        }
+        if (val < 0 || val > 0xff || val == mcmd.moff) {
+            device_printf(dev, "ignoring invalid %s=%d\n", name, val);
+            break;
+        }
+        sc->mspeed[sc->nmspeeds++] = val;
+    }
+    sc->trigger = ACERHDF_TRIGGER_NONE;
+    read_cpu_time(sc->cp_last);
+    sc->sensor = ACERHDF_SENSOR_EC;
+    sc->calibrate = 6; // ticks
+    sc->calibrate_delta = 3; // degree celsius
+    sc->die_supported = cpu_vendor_id == CPU_VENDOR_INTEL &&
+        (cpu_power_eax & CPUTPM1_SENSOR);
+
+    sc->min_interval = ACERHDF_MIN_INTERVAL;
+    sc->ec_probe = acerhdf_probe_ec(sc) == 0;
+    if (sc->ec_probe) {
+        sc->interval = MAX(sc->interval, sc->min_interval);
+    } else {
+        device_printf(dev, "EC probe failed, fan control unavailable\n");
+    }
+
+    callout_init(&sc->tick_handle, CALLOUT_MPSAFE);
+    callout_reset(&sc->tick_handle, sc->interval * hz, acerhdf_tick, sc);
 
     SYSCTL_ADD_PROC(sc->sysctl_ctx,
                     SYSCTL_CHILDREN(sc->sysctl_tree),
@@ -674,6 +1333,42 @@ acerhdf_attach(device_t dev)
                     "I",
                     "Temperature check interval in s");
 
+    SYSCTL_ADD_INT(sc->sysctl_ctx,
+                   SYSCTL_CHILDREN(sc->sysctl_tree),
+                   OID_AUTO,
+                   "min_interval",
+                   CTLFLAG_RD,
+                   &sc->min_interval,
+                   0,
+                   "Shortest temperature check interval in s the EC allows");
+
+    SYSCTL_ADD_INT(sc->sysctl_ctx,
+                   SYSCTL_CHILDREN(sc->sysctl_tree),
+                   OID_AUTO,
+                   "ec_probe",
+                   CTLFLAG_RD,
+                   &sc->ec_probe,
+                   0,
+                   "EC probe at attach: 1 = passed, 0 = failed");
+
+    SYSCTL_ADD_INT(sc->sysctl_ctx,
+                   SYSCTL_CHILDREN(sc->sysctl_tree),
+                   OID_AUTO,
+                   "ec_latency_avg",
+                   CTLFLAG_RD,
+                   &sc->ec_latency_avg,
+                   0,
+                   "Average EC read latency in us measured at attach");
+
+    SYSCTL_ADD_INT(sc->sysctl_ctx,
+                   SYSCTL_CHILDREN(sc->sysctl_tree),
+                   OID_AUTO,
+                   "ec_latency_max",
+                   CTLFLAG_RD,
+                   &sc->ec_latency_max,
+                   0,
+                   "Maximum EC read latency in us measured at attach");
+
     SYSCTL_ADD_PROC(sc->sysctl_ctx,
                     SYSCTL_CHILDREN(sc->sysctl_tree),
                     OID_AUTO,
@@ -707,6 +1402,162 @@ acerhdf_attach(device_t dev)
                     "I",
                     "The temperature at which the fan should be turned off again");
 
+    SYSCTL_ADD_PROC(sc->sysctl_ctx,
+                    SYSCTL_CHILDREN(sc->sysctl_tree),
+                    OID_AUTO,
+                    "speeds",
+                    CTLTYPE_STRING | CTLFLAG_RW,
+                    sc,
+                    0,
+                    acerhdf_sysctl_speeds,
+                    "A",
+                    "Comma separated temperatures at which each manual fan speed is used");
+
+    SYSCTL_ADD_INT(sc->sysctl_ctx,
+                   SYSCTL_CHILDREN(sc->sysctl_tree),
+                   OID_AUTO,
+                   "speed",
+                   CTLFLAG_RD,
+                   &sc->speed,
+                   0,
+                   "Current manual fan speed, 0 = off or BIOS controlled, -1 = unknown");
+
+    SYSCTL_ADD_PROC(sc->sysctl_ctx,
+                    SYSCTL_CHILDREN(sc->sysctl_tree),
+                    OID_AUTO,
+                    "loadon",
+                    CTLTYPE_INT | CTLFLAG_RW,
+                    sc,
+                    0,
+                    acerhdf_sysctl_loadon,
+                    "I",
+                    "CPU load in % at which the fan should be turned on early, 0 = disabled");
+
+    SYSCTL_ADD_INT(sc->sysctl_ctx,
+                   SYSCTL_CHILDREN(sc->sysctl_tree),
+                   OID_AUTO,
+                   "load",
+                   CTLFLAG_RD,
+                   &sc->load,
+                   0,
+                   "CPU load in % during the last interval");
+
+    SYSCTL_ADD_INT(sc->sysctl_ctx,
+                   SYSCTL_CHILDREN(sc->sysctl_tree),
+                   OID_AUTO,
+                   "fanon_count",
+                   CTLFLAG_RD,
+                   &sc->fanon_count,
+                   0,
+                   "Times the fan was turned on by the fanon threshold");
+
+    SYSCTL_ADD_INT(sc->sysctl_ctx,
+                   SYSCTL_CHILDREN(sc->sysctl_tree),
+                   OID_AUTO,
+                   "fanon_peak",
+                   CTLFLAG_RD,
+                   &sc->fanon_peak,
+                   0,
+                   "Peak temperature while turned on by the fanon threshold");
+
+    SYSCTL_ADD_INT(sc->sysctl_ctx,
+                   SYSCTL_CHILDREN(sc->sysctl_tree),
+                   OID_AUTO,
+                   "loadon_count",
+                   CTLFLAG_RD,
+                   &sc->loadon_count,
+                   0,
+                   "Times the fan was turned on early by the loadon threshold");
+
+    SYSCTL_ADD_INT(sc->sysctl_ctx,
+                   SYSCTL_CHILDREN(sc->sysctl_tree),
+                   OID_AUTO,
+                   "loadon_peak",
+                   CTLFLAG_RD,
+                   &sc->loadon_peak,
+                   0,
+                   "Peak temperature while turned on by the loadon threshold");
+
+    SYSCTL_ADD_PROC(sc->sysctl_ctx,
+                    SYSCTL_CHILDREN(sc->sysctl_tree),
+                    OID_AUTO,
+                    "stats_reset",
+                    CTLTYPE_INT | CTLFLAG_RW,
+                    sc,
+                    0,
+                    acerhdf_sysctl_stats_reset,
+                    "I",
+                    "Write 1 to reset the fanon/loadon counts and peaks");
+
+    SYSCTL_ADD_PROC(sc->sysctl_ctx,
+                    SYSCTL_CHILDREN(sc->sysctl_tree),
+                    OID_AUTO,
+                    "sensor",
+                    CTLTYPE_INT | CTLFLAG_RW,
+                    sc,
+                    0,
+                    acerhdf_sysctl_sensor,
+                    "I",
+                    "Temperature source: 0 = EC, 1 = on-die sensor calibrated against the EC");
+
+    SYSCTL_ADD_PROC(sc->sysctl_ctx,
+                    SYSCTL_CHILDREN(sc->sysctl_tree),
+                    OID_AUTO,
+                    "calibrate",
+                    CTLTYPE_INT | CTLFLAG_RW,
+                    sc,
+                    0,
+                    acerhdf_sysctl_calibrate,
+                    "I",
+                    "Read the EC temperature at least every this many checks");
+
+    SYSCTL_ADD_PROC(sc->sysctl_ctx,
+                    SYSCTL_CHILDREN(sc->sysctl_tree),
+                    OID_AUTO,
+                    "calibrate_delta",
+                    CTLTYPE_INT | CTLFLAG_RW,
+                    sc,
+                    0,
+                    acerhdf_sysctl_calibrate_delta,
+                    "I",
+                    "Read the EC temperature when the on-die sensor moved this far from it");
+
+    SYSCTL_ADD_INT(sc->sysctl_ctx,
+                   SYSCTL_CHILDREN(sc->sysctl_tree),
+                   OID_AUTO,
+                   "ec_samples",
+                   CTLFLAG_RD,
+                   &sc->ec_samples,
+                   0,
+                   "Temperature checks that read the EC");
+
+    SYSCTL_ADD_INT(sc->sysctl_ctx,
+                   SYSCTL_CHILDREN(sc->sysctl_tree),
+                   OID_AUTO,
+                   "die_samples",
+                   CTLFLAG_RD,
+                   &sc->die_samples,
+                   0,
+                   "Temperature checks that read the on-die sensor");
+
+    SYSCTL_ADD_INT(sc->sysctl_ctx,
+                   SYSCTL_CHILDREN(sc->sysctl_tree),
+                   OID_AUTO,
+                   "divergence",
+                   CTLFLAG_RD,
+                   &sc->divergence,
+                   0,
+                   "Difference between on-die estimate and EC at the last calibration");
+
+    SYSCTL_ADD_INT(sc->sysctl_ctx,
+                   SYSCTL_CHILDREN(sc->sysctl_tree),
+                   OID_AUTO,
+                   "divergence_max",
+                   CTLFLAG_RD,
+                   &sc->divergence_max,
+                   0,
+                   "Largest difference between on-die estimate and EC");
+
     return 0;
 }
 
@@ -719,7 +1570,7 @@ acerhdf_detach(device_t dev)
     callout_drain(&sc->tick_handle);
 
     ACPI_SERIAL_BEGIN(acerhdf);
-    acerhdf_set_fanstate(sc, ACERHDF_FAN_AUTO);
+    acerhdf_set_fanstate(sc, ACERHDF_FAN_AUTO, 0);
     ACPI_SERIAL_END(acerhdf);
 
     return (0);